@@ -0,0 +1,261 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "async_file_writer.h"
+
+using std::string;
+using std::vector;
+
+AsyncFileWriter::AsyncFileWriter(size_t buffer_size, size_t buffer_count, wss_file_client::FsyncPolicy fsync_policy)
+    : file(nullptr), fsync_policy(fsync_policy), buffers(buffer_count, vector<char>(buffer_size)), current_buffer(0),
+      current_size(0), has_current_buffer(false), finishing(false), failed(false), written_size(0)
+{
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    if (is_open())
+    {
+        close(false);
+    }
+}
+
+int AsyncFileWriter::open(const string& path, size_t file_size, ProgressHandler handler)
+{
+    if (is_open())
+    {
+        return -1;
+    }
+
+    file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        return -1;
+    }
+    std::setvbuf(file, nullptr, _IONBF, 0);    // 数据已经按缓冲区聚合，不再经过stdio缓冲
+
+    // 按文件大小预分配空间，避免大文件产生碎片，空间不足时提前失败
+    if (file_size > 0)
+    {
+#ifdef _WIN32
+        // 只分配磁盘空间，不改变文件长度；_chsize_s会把整个文件填零，相当于多写一遍
+        FILE_ALLOCATION_INFO allocation_info;
+        allocation_info.AllocationSize.QuadPart = static_cast<LONGLONG>(file_size);
+        HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+        int ret = SetFileInformationByHandle(handle, FileAllocationInfo, &allocation_info, sizeof(allocation_info)) ? 0 : -1;
+#else
+        int ret = posix_fallocate(fileno(file), 0, static_cast<off_t>(file_size));
+#endif
+        if (ret != 0)
+        {
+            std::fclose(file);
+            file = nullptr;
+            return -1;
+        }
+    }
+
+    free_buffers = {};
+    full_buffers = {};
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+        free_buffers.push(i);
+    }
+    current_size = 0;
+    has_current_buffer = false;
+    finishing = false;
+    failed = false;
+    written_size = 0;
+    progress_handler = std::move(handler);
+
+    writer = std::thread([this]() { write_loop(); });
+
+    return 0;
+}
+
+int AsyncFileWriter::write(const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        if (failed)
+        {
+            return -1;
+        }
+
+        if (!has_current_buffer)
+        {
+            std::unique_lock<std::mutex> lock(buffer_mutex);
+            buffer_cond.wait(lock, [this]() { return (!free_buffers.empty()) || failed; });
+            if (failed)
+            {
+                return -1;
+            }
+            current_buffer = free_buffers.front();
+            free_buffers.pop();
+            current_size = 0;
+            has_current_buffer = true;
+        }
+
+        vector<char>& buffer = buffers[current_buffer];
+        size_t copy_size = std::min(size, buffer.size() - current_size);
+        std::memcpy(buffer.data() + current_size, data, copy_size);
+        current_size += copy_size;
+        data += copy_size;
+        size -= copy_size;
+
+        if (current_size == buffer.size())
+        {
+            submit_current_buffer();
+        }
+    }
+
+    return 0;
+}
+
+void AsyncFileWriter::flush()
+{
+    if ((!has_current_buffer) || (current_size == 0))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        if (!full_buffers.empty())
+        {
+            return;     // 写线程还有积压时继续聚合，保持大块写入
+        }
+        full_buffers.emplace(current_buffer, current_size);
+    }
+    buffer_cond.notify_all();
+    has_current_buffer = false;
+}
+
+int AsyncFileWriter::close(bool complete)
+{
+    if (!is_open())
+    {
+        return -1;
+    }
+
+    if (has_current_buffer)
+    {
+        submit_current_buffer();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        finishing = true;
+    }
+    buffer_cond.notify_all();
+    writer.join();
+
+    // 文件按完整大小预分配，未完整写入时截断，避免残缺的文件看起来已经下载完成
+    if ((failed || (!complete)) && (truncate_file(written_size) != 0))
+    {
+        failed = true;
+    }
+
+    if ((!failed) && (fsync_policy == wss_file_client::FsyncPolicy::ON_CLOSE) && (sync_file() != 0))
+    {
+        failed = true;
+    }
+
+    if (std::fclose(file) != 0)
+    {
+        failed = true;
+    }
+    file = nullptr;
+    progress_handler = nullptr;
+
+    return failed ? -1 : 0;
+}
+
+bool AsyncFileWriter::is_open() const
+{
+    return file != nullptr;
+}
+
+void AsyncFileWriter::submit_current_buffer()
+{
+    {
+        std::lock_guard<std::mutex> lock(buffer_mutex);
+        full_buffers.emplace(current_buffer, current_size);
+    }
+    buffer_cond.notify_all();
+    has_current_buffer = false;
+}
+
+int AsyncFileWriter::sync_file()
+{
+#ifdef _WIN32
+    return _commit(_fileno(file));
+#else
+    return fsync(fileno(file));
+#endif
+}
+
+int AsyncFileWriter::truncate_file(size_t size)
+{
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), static_cast<__int64>(size));
+#else
+    return ftruncate(fileno(file), static_cast<off_t>(size));
+#endif
+}
+
+void AsyncFileWriter::write_loop()
+{
+    while (true)
+    {
+        std::pair<size_t, size_t> block;
+        {
+            std::unique_lock<std::mutex> lock(buffer_mutex);
+            buffer_cond.wait(lock, [this]() { return (!full_buffers.empty()) || finishing; });
+            if (full_buffers.empty())
+            {
+                break;
+            }
+            block = full_buffers.front();
+            full_buffers.pop();
+        }
+
+        // 出错后继续回收缓冲区，避免接收端阻塞在等待空闲缓冲区上
+        if (!failed)
+        {
+            if (std::fwrite(buffers[block.first].data(), 1, block.second, file) != block.second)
+            {
+                failed = true;
+            }
+            else if ((fsync_policy == wss_file_client::FsyncPolicy::EVERY_BUFFER) && (sync_file() != 0))
+            {
+                failed = true;
+            }
+            else
+            {
+                written_size += block.second;
+                if (progress_handler)
+                {
+                    progress_handler(written_size);
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(buffer_mutex);
+            free_buffers.push(block.first);
+        }
+        buffer_cond.notify_all();
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef _ASYNC_FILE_WRITER_H_INCLUDED_
+#define _ASYNC_FILE_WRITER_H_INCLUDED_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <utility>
+#include <functional>
+#include <condition_variable>
+
+using std::string;
+using std::vector;
+
+namespace wss_file_client
+{
+    constexpr size_t WRITE_BUFFER_SIZE = 1024 * 1024;
+    constexpr size_t WRITE_BUFFER_COUNT = 8;
+
+    enum class FsyncPolicy
+    {
+        NONE,           // 交给操作系统回写
+        ON_CLOSE,       // 关闭文件前同步一次
+        EVERY_BUFFER    // 每写完一个缓冲区同步一次
+    };
+}
+
+// 接收数据先拷贝到固定数量的可复用缓冲区中，由独立的写线程落盘，网络读取不再等待磁盘写入
+class AsyncFileWriter
+{
+public:
+    using ProgressHandler = std::function<void(size_t written_size)>;   // 在写线程中调用
+
+private:
+    FILE* file;
+    wss_file_client::FsyncPolicy fsync_policy;
+    vector<vector<char>> buffers;
+    std::queue<size_t> free_buffers;
+    std::queue<std::pair<size_t, size_t>> full_buffers;     // 缓冲区下标, 数据长度
+    size_t current_buffer;
+    size_t current_size;
+    bool has_current_buffer;
+    bool finishing;
+    std::atomic<bool> failed;
+    size_t written_size;    // 只在写线程中修改，close()在线程结束后读取
+    std::mutex buffer_mutex;
+    std::condition_variable buffer_cond;
+    std::thread writer;
+    ProgressHandler progress_handler;
+
+    void write_loop();
+    void submit_current_buffer();
+    int sync_file();
+    int truncate_file(size_t size);
+
+public:
+    AsyncFileWriter(size_t buffer_size, size_t buffer_count, wss_file_client::FsyncPolicy fsync_policy);
+    ~AsyncFileWriter();
+
+    AsyncFileWriter(const AsyncFileWriter&) = delete;
+    AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+    int open(const string& path, size_t file_size, ProgressHandler handler = nullptr);
+    int write(const char* data, size_t size);
+    void flush();   // 写线程空闲时提交未写满的缓冲区，降低进度通知的延迟
+    int close(bool complete = true);   // complete为false或写入失败时截断到实际写入的长度
+    bool is_open() const;
+};
+
+#endif /* _ASYNC_FILE_WRITER_H_INCLUDED_ */
@@ -1,5 +1,7 @@
+#include <mutex>
+#include <cerrno>
+#include <cstdlib>
 #include <filesystem>
-#include <fstream>
 #include <regex>
 #include <string>
 #include <vector>
@@ -16,7 +18,6 @@ namespace net = boost::asio;
 namespace ssl = boost::asio::ssl;
 
 using tcp = boost::asio::ip::tcp;
-using std::ofstream;
 using std::string;
 using std::vector;
 using std::shared_ptr;
@@ -26,17 +27,43 @@ const char* CLIENT_LOG_PATH = "./log/wss_file_client.log";
 
 shared_ptr<spdlog::logger> WssFileClient::logger = nullptr;
 
-WssFileClient::WssFileClient(const char* host, uint16_t port, const char* cert_file)
-    : connected(false), net_context(1), ssl_context(ssl::context::tls_client), ws(net_context, ssl_context),
-      host(host), port(port)
+bool wss_file_client::parse_number(const char* str, unsigned long min_value, unsigned long max_value, unsigned long& value)
 {
-    if (logger == nullptr)
+    char* end = nullptr;
+    errno = 0;
+    unsigned long result = std::strtoul(str, &end, 10);
+    if ((errno != 0) || (end == str) || (*end != '\0') || (result < min_value) || (result > max_value))
     {
+        return false;
+    }
+
+    value = result;
+    return true;
+}
+
+bool wss_file_client::parse_port(const char* str, uint16_t& port)
+{
+    unsigned long value = 0;
+    if (!parse_number(str, 1, 65535, value))
+    {
+        return false;
+    }
+
+    port = static_cast<uint16_t>(value);
+    return true;
+}
+
+WssFileClient::WssFileClient(const char* host, uint16_t port, const char* cert_file, wss_file_client::FsyncPolicy fsync_policy)
+    : connected(false), net_context(1), ssl_context(ssl::context::tls_client), ws(net_context, ssl_context),
+      host(host), port(port), file_writer(wss_file_client::WRITE_BUFFER_SIZE, wss_file_client::WRITE_BUFFER_COUNT, fsync_policy)
+{
+    static std::once_flag logger_once;    // 服务器边缘缓存模式下会在多个线程中创建客户端
+    std::call_once(logger_once, []() {
         auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
         auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(CLIENT_LOG_PATH, wss_file_client::MAX_LOG_SIZE, wss_file_client::MAX_LOG_COUNT);
         vector<spdlog::sink_ptr> sinks = {console_sink, file_sink};
-        logger = std::make_shared<spdlog::logger>("wss_file_server", sinks.begin(), sinks.end());
-    }
+        logger = std::make_shared<spdlog::logger>("wss_file_client", sinks.begin(), sinks.end());
+    });
 
     ssl_context.set_options(ssl::context::default_workarounds | ssl::context::no_sslv2 | ssl::context::no_sslv3 | ssl::context::no_tlsv1 | ssl::context::no_tlsv1_1 | ssl::context::single_dh_use);
     std::filesystem::path cert_file_path(cert_file);
@@ -50,6 +77,19 @@ WssFileClient::WssFileClient(const char* host, uint16_t port, const char* cert_f
     ws.next_layer().set_verify_callback(ssl::host_name_verification(this->host));
 }
 
+// beast的超时只对异步操作生效，网络操作以异步方式发起后在当前线程等待完成，超时后连接被关闭
+template <typename AsyncOperation>
+beast::error_code WssFileClient::run_with_timeout(AsyncOperation&& operation)
+{
+    beast::error_code result;
+    ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_client::NETWORK_TIMEOUT));
+    operation([&result](beast::error_code ec, auto&&...) { result = ec; });
+    net_context.restart();
+    net_context.run();
+
+    return result;
+}
+
 WssFileClient::~WssFileClient()
 {
     if (connected)
@@ -70,7 +110,7 @@ int WssFileClient::connect()
     tcp::resolver resolver(net_context);
     const auto results = resolver.resolve(host, std::to_string(port));
 
-    ws.next_layer().next_layer().connect(results, ec);
+    ec = run_with_timeout([&](auto handler) { ws.next_layer().next_layer().async_connect(results, handler); });
     if (ec)
     {
         logger->error("connect error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
@@ -79,14 +119,14 @@ int WssFileClient::connect()
 
     SSL_set_tlsext_host_name(ws.next_layer().native_handle(), host.c_str());  // 设置SNI
 
-    ws.next_layer().handshake(ssl::stream_base::client, ec);
+    ec = run_with_timeout([&](auto handler) { ws.next_layer().async_handshake(ssl::stream_base::client, handler); });
     if (ec)
     {
         logger->error("handshake error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
         return -1;
     }
 
-    ws.handshake(host, "/", ec);
+    ec = run_with_timeout([&](auto handler) { ws.async_handshake(host, "/", handler); });
     if (ec)
     {
         logger->error("handshake error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
@@ -99,6 +139,14 @@ int WssFileClient::connect()
 }
 
 int WssFileClient::download_file(string_view file_name)
+{
+    std::filesystem::path file_path(DOWNLOAD_DIR);
+    file_path.append(file_name);
+
+    return download_file(file_name, file_path.string(), nullptr);
+}
+
+int WssFileClient::download_file(string_view file_name, const string& save_path, DownloadProgressHandler handler)
 {
     if (!connected)
     {
@@ -108,10 +156,22 @@ int WssFileClient::download_file(string_view file_name)
 
     string request = "FILE: ";
     request += file_name;
-    ws.write(net::buffer(request));
+    beast::error_code ec = run_with_timeout([&](auto handler) { ws.async_write(net::buffer(request), handler); });
+    if (ec)
+    {
+        logger->error("write error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+        connected = false;
+        return -1;
+    }
 
     beast::flat_buffer net_buffer;
-    ws.read(net_buffer);
+    ec = run_with_timeout([&](auto handler) { ws.async_read(net_buffer, handler); });
+    if (ec)
+    {
+        logger->error("read error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+        connected = false;
+        return -1;
+    }
     string response = beast::buffers_to_string(net_buffer.data());
     net_buffer.consume(net_buffer.size());
 
@@ -127,44 +187,87 @@ int WssFileClient::download_file(string_view file_name)
     if (file_name_received != file_name)
     {
         logger->error("file name error: {}", file_name_received);
-        ws.close(websocket::close_code::normal);
+        disconnect();
         return -1;
     }
     size_t file_size = std::stoul(std::regex_replace(response, valid_response, "$2"));
 
-    std::filesystem::path file_path(DOWNLOAD_DIR);
-    file_path.append(file_name);
-
-    ofstream file(file_path.string(), std::ios::binary);
-    if (!file.is_open())
+    AsyncFileWriter::ProgressHandler write_handler = nullptr;
+    if (handler)
     {
-        logger->error("open file error: {}", file_path.string());
-        return -1;
+        write_handler = [handler, file_size](size_t written_size) { handler(file_size, written_size); };
+    }
+    // 打开或写入失败后继续接收剩余数据，保持连接上的协议同步
+    bool file_opened = (file_writer.open(save_path, file_size, write_handler) == 0);
+    if (!file_opened)
+    {
+        logger->error("open file error: {}", save_path);
+    }
+    else if (handler)
+    {
+        handler(file_size, 0);
     }
 
-    ws.binary(true);
     size_t received_size = 0;
+    bool write_error = !file_opened;
+    ws.binary(true);
     while (received_size < file_size)
     {
-        ws.read(net_buffer);
-        file.write(static_cast<const char*>(net_buffer.data().data()), net_buffer.size());
+        ec = run_with_timeout([&](auto handler) { ws.async_read(net_buffer, handler); });
+        if (ec)
+        {
+            break;
+        }
+        if ((!write_error) && (file_writer.write(static_cast<const char*>(net_buffer.data().data()), net_buffer.size()) != 0))
+        {
+            write_error = true;
+        }
+        if ((!write_error) && handler)
+        {
+            file_writer.flush();    // 有进度回调时数据需要尽快落盘，供边缘服务器边写边转发
+        }
         received_size += net_buffer.size();
         net_buffer.consume(net_buffer.size());
     }
 
-    ws.binary(false);
-    ws.read(net_buffer);
-    response = beast::buffers_to_string(net_buffer.data());
-    net_buffer.consume(net_buffer.size());
-    if (response != "FILE END")
+    if (!ec)
+    {
+        ws.binary(false);
+        ec = run_with_timeout([&](auto handler) { ws.async_read(net_buffer, handler); });
+        response = beast::buffers_to_string(net_buffer.data());
+        net_buffer.consume(net_buffer.size());
+    }
+
+    if (ec)
+    {
+        logger->error("read error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+        if (file_opened)
+        {
+            file_writer.close(false);
+        }
+        connected = false;
+        return -1;
+    }
+
+    if (!file_opened)
     {
-        logger->error("response error: {}", response);
         return -1;
     }
 
-    file.close();
+    bool complete = (response == "FILE END");
+    int close_ret = file_writer.close(complete);
+    if (!complete)
+    {
+        logger->error("response error: {}", response);
+        return -1;
+    }
+    if (close_ret != 0)
+    {
+        logger->error("write file error: {}", save_path);
+        return -1;
+    }
 
-    logger->info("download success: {}", file_path.string());
+    logger->info("download success: {}", save_path);
 
     return 0;
 }
@@ -177,9 +280,18 @@ int WssFileClient::disconnect()
         return -1;
     }
 
-    ws.close(websocket::close_code::normal);
-
+    beast::error_code ec = run_with_timeout([&](auto handler) { ws.async_close(websocket::close_code::normal, handler); });
     connected = false;
+    if (ec)
+    {
+        logger->error("close error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+        return -1;
+    }
 
     return 0;
 }
+
+bool WssFileClient::is_connected() const
+{
+    return connected;
+}
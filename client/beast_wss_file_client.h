@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <functional>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
@@ -12,6 +13,8 @@
 #include <boost/beast/ssl.hpp>
 #include <spdlog/spdlog.h>
 
+#include "async_file_writer.h"
+
 namespace beast = boost::beast;
 namespace websocket = beast::websocket;
 namespace net = boost::asio;
@@ -25,12 +28,21 @@ using std::shared_ptr;
 
 namespace wss_file_client
 {
+    constexpr int64_t NETWORK_TIMEOUT = 10; // seconds
     constexpr size_t MAX_LOG_SIZE = 5 * 1024 * 1024;
     constexpr size_t MAX_LOG_COUNT = 3;
+
+    // 解析[min_value, max_value]范围内的十进制数，格式错误或越界时返回false
+    bool parse_number(const char* str, unsigned long min_value, unsigned long max_value, unsigned long& value);
+    bool parse_port(const char* str, uint16_t& port);
 }
 
 class WssFileClient
 {
+public:
+    // 收到文件大小后以written_size = 0调用一次，之后在写线程中每落盘一个缓冲区调用一次
+    using DownloadProgressHandler = std::function<void(size_t file_size, size_t written_size)>;
+
 private:
     bool connected;
     net::io_context net_context;
@@ -38,15 +50,22 @@ private:
     websocket::stream<beast::ssl_stream<beast::tcp_stream>> ws;
     string host;
     uint16_t port;
+    AsyncFileWriter file_writer;
     static shared_ptr<spdlog::logger> logger;
 
+    template <typename AsyncOperation>
+    beast::error_code run_with_timeout(AsyncOperation&& operation);
+
 public:
-    WssFileClient(const char* host, uint16_t port, const char* cert_file);
+    WssFileClient(const char* host, uint16_t port, const char* cert_file,
+                  wss_file_client::FsyncPolicy fsync_policy = wss_file_client::FsyncPolicy::NONE);
     ~WssFileClient();
 
     int connect();
     int download_file(string_view file_name);
+    int download_file(string_view file_name, const string& save_path, DownloadProgressHandler handler);
     int disconnect();
+    bool is_connected() const;     // 网络错误后连接会被标记为断开
 };
 
 #endif /* _BEAST_WSS_FILE_CLIENT_H_INCLUDED_ */
@@ -3,22 +3,27 @@
 #include "beast_wss_file_client.h"
 
 const char* CERT_FILE = "./certificate/test_crt.crt";
+constexpr uint16_t DEFAULT_PORT = 34094;
 
 int main(int argc, char* argv[])
 {
-    if (argc != 2)
+    uint16_t port = DEFAULT_PORT;
+    if (((argc != 2) && (argc != 3)) || ((argc == 3) && (!wss_file_client::parse_port(argv[2], port))))
     {
-        spdlog::error("Usage: {} <file_name>", argv[0]);
+        spdlog::error("Usage: {} <file_name> [port]", argv[0]);
         return -1;
     }
 
     const char* file_name = argv[1];
 
-    WssFileClient client("127.0.0.1", 34094, CERT_FILE);
+    WssFileClient client("127.0.0.1", port, CERT_FILE);
 
     client.connect();
     client.download_file(file_name);
-    client.disconnect();
+    if (client.is_connected())
+    {
+        client.disconnect();
+    }
 
     return 0;
 }
@@ -1,7 +1,9 @@
 #include <cstdlib>
+#include <algorithm>
 #include <thread>
 #include <cstdint>
 #include <filesystem>
+#include <exception>
 
 #include <boost/locale.hpp>
 #include <boost/beast/core.hpp>
@@ -9,6 +11,7 @@
 #include <spdlog/sinks/rotating_file_sink.h>
 
 #include "beast_wss_file_server.h"
+#include "beast_wss_file_client.h"
 
 namespace beast = boost::beast;
 namespace websocket = beast::websocket;
@@ -25,9 +28,254 @@ using std::shared_ptr;
 const char* FILE_DIR = "./files";
 const char* SERVER_LOG_PATH = "./log/wss_file_server.log";
 const char* SERVER_SESSION_LOG_PATH = "./log/wss_file_server_session.log";
+const char* SERVER_CACHE_LOG_PATH = "./log/wss_file_server_cache.log";
+const char* CACHE_TMP_DIR = "./cache_tmp";
 
 shared_ptr<spdlog::async_logger> WssFileServerSession::logger = nullptr;
 shared_ptr<spdlog::logger> WssFileServer::logger = nullptr;
+shared_ptr<spdlog::logger> UpstreamCache::logger = nullptr;
+
+UpstreamFetch::UpstreamFetch(const string& file_name, const string& part_path)
+    : file_name(file_name), part_path(part_path), current_status{0, State::FETCHING, false, 0, 0}, readers(0), committed(false)
+{
+}
+
+const string& UpstreamFetch::get_file_name() const
+{
+    return file_name;
+}
+
+const string& UpstreamFetch::get_part_path() const
+{
+    return part_path;
+}
+
+UpstreamFetch::Status UpstreamFetch::status()
+{
+    std::lock_guard<std::mutex> lock(status_mutex);
+    return current_status;
+}
+
+void UpstreamFetch::async_wait(uint64_t seen_version, std::function<void()> handler)
+{
+    {
+        std::lock_guard<std::mutex> lock(status_mutex);
+        if (current_status.version == seen_version)
+        {
+            waiters.push_back(std::move(handler));
+            return;
+        }
+    }
+
+    handler();
+}
+
+void UpstreamFetch::update(const std::function<void(Status&)>& modifier)
+{
+    vector<std::function<void()>> ready_waiters;
+    {
+        std::lock_guard<std::mutex> lock(status_mutex);
+        modifier(current_status);
+        ++current_status.version;
+        ready_waiters.swap(waiters);
+    }
+
+    for (auto& i : ready_waiters)
+    {
+        i();
+    }
+}
+
+UpstreamCache::UpstreamCache(const char* host, uint16_t port, const char* cert_file, size_t fetch_thread_num)
+    : host(host), port(port), cert_file(cert_file), next_fetch_id(0), fetch_pool(fetch_thread_num)
+{
+    if (logger == nullptr)
+    {
+        auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+        auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(SERVER_CACHE_LOG_PATH, wss_file_server::MAX_LOG_SIZE, wss_file_server::MAX_LOG_COUNT);
+        vector<spdlog::sink_ptr> sinks = {console_sink, file_sink};
+        logger = std::make_shared<spdlog::logger>("wss_file_server_cache", sinks.begin(), sinks.end());
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(CACHE_TMP_DIR, ec);
+    if (ec)
+    {
+        logger->error("create cache dir error: {}", ec.message());
+        return;
+    }
+
+    // 清理上次运行残留的未完成文件
+    for (const auto& i : std::filesystem::directory_iterator(CACHE_TMP_DIR, ec))
+    {
+        if (i.path().extension() == ".part")
+        {
+            std::filesystem::remove(i.path(), ec);
+        }
+    }
+}
+
+UpstreamCache::~UpstreamCache()
+{
+    fetch_pool.join();
+}
+
+shared_ptr<UpstreamFetch> UpstreamCache::acquire(const string& file_name)
+{
+    // 按规范化后的路径合并请求，a.txt和./a.txt共用同一次上游下载
+    string cache_key = std::filesystem::path(file_name).lexically_normal().generic_string();
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto it = fetches.find(cache_key);
+    if (it != fetches.end())
+    {
+        ++it->second->readers;
+        return it->second;
+    }
+
+    std::error_code ec;
+    std::filesystem::path file_path(FILE_DIR);
+    file_path.append(cache_key);
+    if (std::filesystem::exists(file_path, ec))
+    {
+        return nullptr;
+    }
+
+    std::filesystem::path part_path(CACHE_TMP_DIR);
+    part_path.append(std::to_string(next_fetch_id++) + ".part");
+    shared_ptr<UpstreamFetch> upstream_fetch = std::make_shared<UpstreamFetch>(cache_key, part_path.string());
+    upstream_fetch->readers = 1;
+    fetches.emplace(cache_key, upstream_fetch);
+
+    logger->info("cache miss: {}", cache_key);
+    net::post(fetch_pool, [this, upstream_fetch]() { run_fetch(upstream_fetch); });
+
+    return upstream_fetch;
+}
+
+void UpstreamCache::release(const shared_ptr<UpstreamFetch>& upstream_fetch)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    --upstream_fetch->readers;
+    if ((upstream_fetch->readers == 0) && (upstream_fetch->status().state != UpstreamFetch::State::FETCHING))
+    {
+        commit(upstream_fetch);
+    }
+}
+
+void UpstreamCache::run_fetch(const shared_ptr<UpstreamFetch>& upstream_fetch)
+{
+    // 排队期间请求方已全部超时离开，不再占用线程下载
+    bool abandoned = false;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        abandoned = (upstream_fetch->readers == 0);
+    }
+    if (abandoned)
+    {
+        logger->info("fetch abandoned: {}", upstream_fetch->get_file_name());
+        on_fetch_finish(upstream_fetch, false);
+        return;
+    }
+
+    bool success = false;
+
+    try
+    {
+        WssFileClient client(host.c_str(), port, cert_file.c_str());
+        if (client.connect() == 0)
+        {
+            int ret = client.download_file(upstream_fetch->get_file_name(), upstream_fetch->get_part_path(),
+                [&upstream_fetch](size_t file_size, size_t written_size) {
+                    upstream_fetch->update([file_size, written_size](UpstreamFetch::Status& status) {
+                        status.size_known = true;
+                        status.file_size = file_size;
+                        status.written_size = written_size;
+                    });
+                });
+            success = (ret == 0);
+            if (client.is_connected())
+            {
+                client.disconnect();
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        logger->error("fetch error: {}", boost::locale::conv::between(e.what(), "UTF-8", "GBK"));
+    }
+
+    if (!success)
+    {
+        logger->error("fetch from upstream failed: {}", upstream_fetch->get_file_name());
+    }
+
+    on_fetch_finish(upstream_fetch, success);
+}
+
+void UpstreamCache::on_fetch_finish(const shared_ptr<UpstreamFetch>& upstream_fetch, bool success)
+{
+    upstream_fetch->update([success](UpstreamFetch::Status& status) {
+        status.state = success ? UpstreamFetch::State::DONE : UpstreamFetch::State::FAILED;
+    });
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    // 失败的下载立即移除，后续请求重新向上游获取
+    auto it = fetches.find(upstream_fetch->get_file_name());
+    if ((!success) && (it != fetches.end()) && (it->second == upstream_fetch))
+    {
+        fetches.erase(it);
+    }
+
+    if (upstream_fetch->readers == 0)
+    {
+        commit(upstream_fetch);
+    }
+}
+
+void UpstreamCache::commit(const shared_ptr<UpstreamFetch>& upstream_fetch)
+{
+    // 调用者持有cache_mutex，且没有会话再读取缓存文件
+    if (upstream_fetch->committed)
+    {
+        return;
+    }
+    upstream_fetch->committed = true;
+
+    bool cached = false;
+    if (upstream_fetch->status().state == UpstreamFetch::State::DONE)
+    {
+        std::error_code ec;
+        std::filesystem::path file_path(FILE_DIR);
+        file_path.append(upstream_fetch->get_file_name());
+        std::filesystem::create_directories(file_path.parent_path(), ec);
+        std::filesystem::rename(upstream_fetch->get_part_path(), file_path, ec);
+        if (ec)
+        {
+            logger->error("cache file error: {} {}", file_path.string(), ec.message());
+        }
+        else
+        {
+            logger->info("cached: {}", file_path.string());
+            cached = true;
+        }
+    }
+
+    if (!cached)
+    {
+        std::error_code ec;
+        std::filesystem::remove(upstream_fetch->get_part_path(), ec);
+    }
+
+    auto it = fetches.find(upstream_fetch->get_file_name());
+    if ((it != fetches.end()) && (it->second == upstream_fetch))
+    {
+        fetches.erase(it);
+    }
+}
 
 void WssFileServerSession::on_ssl_handshake()
 {
@@ -122,6 +370,16 @@ bool WssFileServerSession::is_save_path(const string& path)
 
 void WssFileServerSession::send_file()
 {
+    if (upstream_cache != nullptr)
+    {
+        upstream_fetch = upstream_cache->acquire(file_name);
+        if (upstream_fetch != nullptr)
+        {
+            send_upstream_file();
+            return;
+        }
+    }
+
     std::filesystem::path file_path(FILE_DIR);
     file_path.append(file_name);
 
@@ -187,6 +445,7 @@ void WssFileServerSession::send_next_block(size_t file_size, size_t sent_size)
 void WssFileServerSession::send_file_end()
 {
     file.close();
+    release_upstream_fetch();
 
     ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_server::NETWORK_TIMEOUT));
     std::shared_ptr<string> response = std::make_shared<string>("FILE END");
@@ -201,6 +460,164 @@ void WssFileServerSession::send_file_end()
     });
 }
 
+void WssFileServerSession::send_upstream_file()
+{
+    UpstreamFetch::Status status = upstream_fetch->status();
+    if (!status.size_known)
+    {
+        if (status.state == UpstreamFetch::State::FAILED)
+        {
+            send_upstream_not_found();
+            return;
+        }
+
+        wait_upstream(status.version, [self = shared_from_this()]() { self->send_upstream_file(); },
+                      [self = shared_from_this()]() { self->send_upstream_not_found(); });
+        return;
+    }
+
+    file.open(upstream_fetch->get_part_path(), std::ios::binary);
+    if (!file.is_open())
+    {
+        ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_server::NETWORK_TIMEOUT));
+        std::shared_ptr<string> response = std::make_shared<string>("SERVER FILE OPEN ERROR");
+        ws.async_write(net::buffer(*response), [self = shared_from_this()](beast::error_code ec, size_t) {
+            if (ec)
+            {
+                logger->error("write error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+                return;
+            }
+
+            self->session_close();
+        });
+        return;
+    }
+
+    size_t file_size = status.file_size;
+
+    ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_server::NETWORK_TIMEOUT));
+    std::shared_ptr<string> response = std::make_shared<string>("FILE: " + file_name + " SIZE: " + std::to_string(file_size));
+    ws.async_write(net::buffer(*response), [self = shared_from_this(), file_size](beast::error_code ec, size_t) {
+        if (ec)
+        {
+            logger->error("write error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+            return;
+        }
+
+        self->ws.binary(true);
+        self->send_next_upstream_block(file_size, 0);
+    });
+}
+
+void WssFileServerSession::send_next_upstream_block(size_t file_size, size_t sent_size)
+{
+    if (sent_size >= file_size)
+    {
+        ws.binary(false);
+        send_file_end();
+        return;
+    }
+
+    UpstreamFetch::Status status = upstream_fetch->status();
+    if (status.state == UpstreamFetch::State::FAILED)
+    {
+        logger->error("upstream fetch failed: {}", file_name);
+        session_close();
+        return;
+    }
+
+    // 已转发完缓存文件中的数据，等待上游继续写入
+    if (status.written_size <= sent_size)
+    {
+        wait_upstream(status.version, [self = shared_from_this(), file_size, sent_size]() {
+            self->send_next_upstream_block(file_size, sent_size);
+        }, [self = shared_from_this()]() {
+            logger->error("upstream wait timeout: {}", self->file_name);
+            self->session_close();
+        });
+        return;
+    }
+
+    file.clear();
+    file.seekg(sent_size, file.beg);
+    file.read(file_buffer.data(), std::min(file_buffer.size(), status.written_size - sent_size));
+    size_t read_size = file.gcount();
+    if (read_size == 0)
+    {
+        logger->error("read cache file error: {}", upstream_fetch->get_part_path());
+        session_close();
+        return;
+    }
+
+    ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_server::NETWORK_TIMEOUT));
+    ws.async_write(net::buffer(file_buffer.data(), read_size), [self = shared_from_this(), sent_size, read_size, file_size](beast::error_code ec, size_t) {
+        if (ec)
+        {
+            logger->error("write error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+            return;
+        }
+
+        self->send_next_upstream_block(file_size, sent_size + read_size);
+    });
+}
+
+void WssFileServerSession::send_upstream_not_found()
+{
+    release_upstream_fetch();
+
+    ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_server::NETWORK_TIMEOUT));
+    std::shared_ptr<string> response = std::make_shared<string>("FILE NOT FOUND");
+    ws.async_write(net::buffer(*response), [self = shared_from_this()](beast::error_code ec, size_t) {
+        if (ec)
+        {
+            logger->error("write error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
+            return;
+        }
+
+        self->session_close();
+    });
+}
+
+void WssFileServerSession::wait_upstream(uint64_t seen_version, std::function<void()> handler, std::function<void()> timeout_handler)
+{
+    // 进度回调和超时都在会话的strand上执行，先到的一方生效
+    uint64_t wait_id = ++upstream_wait_id;
+
+    upstream_timer.expires_after(std::chrono::seconds(wss_file_server::UPSTREAM_WAIT_TIMEOUT));
+    upstream_timer.async_wait([self = shared_from_this(), wait_id, timeout_handler = std::move(timeout_handler)](beast::error_code ec) {
+        if (ec || (wait_id != self->upstream_wait_id))
+        {
+            return;
+        }
+
+        ++self->upstream_wait_id;
+        timeout_handler();
+    });
+
+    // 回调在下载线程中触发，转回会话所在的执行器继续处理
+    upstream_fetch->async_wait(seen_version, [self = shared_from_this(), wait_id, handler = std::move(handler)]() {
+        net::post(self->ws.get_executor(), [self, wait_id, handler]() {
+            if (wait_id != self->upstream_wait_id)
+            {
+                return;
+            }
+
+            ++self->upstream_wait_id;
+            self->upstream_timer.cancel();
+            handler();
+        });
+    });
+}
+
+void WssFileServerSession::release_upstream_fetch()
+{
+    if (upstream_fetch != nullptr)
+    {
+        upstream_cache->release(upstream_fetch);
+        upstream_fetch = nullptr;
+    }
+}
+
 void WssFileServerSession::session_close()
 {
     ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_server::NETWORK_TIMEOUT));
@@ -216,8 +633,9 @@ void WssFileServerSession::session_close()
     });
 }
 
-WssFileServerSession::WssFileServerSession(tcp::socket&& socket, ssl::context& ctx)
-    : ws(std::move(socket), ctx), file_buffer(wss_file_server::FILE_BUFFER_SIZE)
+WssFileServerSession::WssFileServerSession(tcp::socket&& socket, ssl::context& ctx, shared_ptr<UpstreamCache> upstream_cache)
+    : ws(std::move(socket), ctx), file_buffer(wss_file_server::FILE_BUFFER_SIZE), upstream_cache(std::move(upstream_cache)),
+      upstream_timer(ws.get_executor()), upstream_wait_id(0)
 {
     if (logger == nullptr)
     {
@@ -228,6 +646,12 @@ WssFileServerSession::WssFileServerSession(tcp::socket&& socket, ssl::context& c
     }
 }
 
+WssFileServerSession::~WssFileServerSession()
+{
+    file.close();   // 先关闭缓存文件再释放，Windows下无法重命名已打开的文件
+    release_upstream_fetch();
+}
+
 void WssFileServerSession::run()
 {
     ws.next_layer().next_layer().expires_after(std::chrono::seconds(wss_file_server::NETWORK_TIMEOUT));
@@ -243,13 +667,14 @@ void WssFileServerSession::run()
 
 void WssFileServer::run()
 {
-    acceptor.async_accept([this](beast::error_code ec, tcp::socket socket) {
+    // 每个会话使用独立的strand，上游进度回调与超时定时器不会并发执行
+    acceptor.async_accept(net::make_strand(net_context), [this](beast::error_code ec, tcp::socket socket) {
         if (ec)
         {
             logger->error("accept error: {}", boost::locale::conv::between(ec.message(), "UTF-8", "GBK"));
             return;
         }
-        std::make_shared<WssFileServerSession>(std::move(socket), ssl_context)->run();
+        std::make_shared<WssFileServerSession>(std::move(socket), ssl_context, upstream_cache)->run();
         run();
     });
 }
@@ -298,6 +723,12 @@ WssFileServer::WssFileServer(const char* ip, uint16_t port, size_t thread_num, c
     }
 }
 
+void WssFileServer::set_upstream(const char* host, uint16_t port, const char* cert_file, size_t fetch_thread_num)
+{
+    upstream_cache = std::make_shared<UpstreamCache>(host, port, cert_file, fetch_thread_num);
+    logger->info("edge cache mode, upstream: {}:{}, fetch threads: {}", host, port, fetch_thread_num);
+}
+
 void WssFileServer::start()
 {
     running = true;
@@ -5,6 +5,9 @@
 #include <vector>
 #include <fstream>
 #include <cstdint>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
@@ -33,8 +36,77 @@ namespace wss_file_server
     constexpr size_t MAX_LOG_COUNT = 3;
     constexpr size_t SESSION_LOG_QUEUE_SIZE = 8192;
     constexpr size_t SESSION_LOG_THREAD_COUNT = 1;
+    constexpr size_t UPSTREAM_FETCH_THREAD_COUNT = 4;   // 默认值，每个线程在整个上游下载期间被占用
+    constexpr int64_t UPSTREAM_WAIT_TIMEOUT = 5;        // seconds，须小于客户端的网络超时，请求方才能收到应答
 }
 
+// 一次正在进行的上游下载，同一文件的并发请求共享同一个实例
+class UpstreamFetch
+{
+public:
+    enum class State
+    {
+        FETCHING,
+        DONE,
+        FAILED
+    };
+
+    struct Status
+    {
+        uint64_t version;       // 每次状态变化加一
+        State state;
+        bool size_known;
+        size_t file_size;
+        size_t written_size;    // 已写入缓存文件的字节数
+    };
+
+private:
+    string file_name;
+    string part_path;
+    std::mutex status_mutex;
+    Status current_status;
+    vector<std::function<void()>> waiters;
+    size_t readers;     // 由UpstreamCache::cache_mutex保护
+    bool committed;     // 由UpstreamCache::cache_mutex保护
+
+    void update(const std::function<void(Status&)>& modifier);
+
+    friend class UpstreamCache;
+
+public:
+    UpstreamFetch(const string& file_name, const string& part_path);
+
+    const string& get_file_name() const;
+    const string& get_part_path() const;
+    Status status();
+    void async_wait(uint64_t seen_version, std::function<void()> handler);  // 状态版本变化后在下载线程中调用handler
+};
+
+// 边缘缓存：本地缺失的文件从上游服务器下载，边写入本地缓存边转发给请求方
+class UpstreamCache
+{
+private:
+    string host;
+    uint16_t port;
+    string cert_file;
+    std::mutex cache_mutex;
+    std::unordered_map<string, shared_ptr<UpstreamFetch>> fetches;
+    uint64_t next_fetch_id;
+    net::thread_pool fetch_pool;
+    static shared_ptr<spdlog::logger> logger;
+
+    void run_fetch(const shared_ptr<UpstreamFetch>& upstream_fetch);
+    void on_fetch_finish(const shared_ptr<UpstreamFetch>& upstream_fetch, bool success);
+    void commit(const shared_ptr<UpstreamFetch>& upstream_fetch);
+
+public:
+    UpstreamCache(const char* host, uint16_t port, const char* cert_file, size_t fetch_thread_num);
+    ~UpstreamCache();
+
+    shared_ptr<UpstreamFetch> acquire(const string& file_name);    // 本地已有该文件时返回nullptr
+    void release(const shared_ptr<UpstreamFetch>& upstream_fetch);
+};
+
 class WssFileServerSession : public std::enable_shared_from_this<WssFileServerSession>
 {
 private:
@@ -43,6 +115,10 @@ private:
     string file_name;
     ifstream file;
     vector<char> file_buffer;
+    shared_ptr<UpstreamCache> upstream_cache;
+    shared_ptr<UpstreamFetch> upstream_fetch;
+    net::steady_timer upstream_timer;
+    uint64_t upstream_wait_id;      // 每次等待结束（进度或超时）后加一，使另一方的回调失效
     static shared_ptr<spdlog::async_logger> logger;
 
     void on_ssl_handshake();
@@ -52,10 +128,16 @@ private:
     void send_file();
     void send_next_block(size_t file_size, size_t sent_size);
     void send_file_end();
+    void send_upstream_file();
+    void send_next_upstream_block(size_t file_size, size_t sent_size);
+    void send_upstream_not_found();
+    void wait_upstream(uint64_t seen_version, std::function<void()> handler, std::function<void()> timeout_handler);
+    void release_upstream_fetch();
     void session_close();
 
 public:
-    WssFileServerSession(tcp::socket&& socket, ssl::context& ctx);
+    WssFileServerSession(tcp::socket&& socket, ssl::context& ctx, shared_ptr<UpstreamCache> upstream_cache);
+    ~WssFileServerSession();
 
     void run();
 };
@@ -69,6 +151,7 @@ private:
     tcp::endpoint endpoint;
     ssl::context ssl_context;
     tcp::acceptor acceptor;
+    shared_ptr<UpstreamCache> upstream_cache;
     static shared_ptr<spdlog::logger> logger;
 
     void run();
@@ -76,6 +159,9 @@ private:
 public:
     WssFileServer(const char* ip, uint16_t port, size_t thread_num, const char* cert_file, const char* cert_key_file);
 
+    // 在start()之前调用，开启边缘缓存模式
+    void set_upstream(const char* host, uint16_t port, const char* cert_file,
+                      size_t fetch_thread_num = wss_file_server::UPSTREAM_FETCH_THREAD_COUNT);
     void start();
 };
 
@@ -1,13 +1,32 @@
 #include "beast_wss_file_server.h"
+#include "beast_wss_file_client.h"
 
 const char* CERT_FILE = "./certificate/test_crt.crt";
 const char* CERT_KEY_FILE = "./certificate/test_crt.key";
+const char* UPSTREAM_CERT_FILE = "./certificate/test_crt.crt";
+constexpr uint16_t DEFAULT_PORT = 34094;
 
-int main()
+int main(int argc, char* argv[])
 {
+    uint16_t port = DEFAULT_PORT;
+    uint16_t upstream_port = 0;
+    unsigned long fetch_thread_num = wss_file_server::UPSTREAM_FETCH_THREAD_COUNT;
+    if (((argc != 1) && (argc != 2) && (argc != 4) && (argc != 5)) ||
+        ((argc >= 2) && (!wss_file_client::parse_port(argv[1], port))) ||
+        ((argc >= 4) && (!wss_file_client::parse_port(argv[3], upstream_port))) ||
+        ((argc == 5) && (!wss_file_client::parse_number(argv[4], 1, 256, fetch_thread_num))))
+    {
+        spdlog::error("Usage: {} [port [upstream_host upstream_port [fetch_threads]]]", argv[0]);
+        return -1;
+    }
+
     spdlog::init_thread_pool(wss_file_server::SESSION_LOG_QUEUE_SIZE, wss_file_server::SESSION_LOG_THREAD_COUNT);
 
-    WssFileServer server("::", 34094, 4, CERT_FILE, CERT_KEY_FILE);
+    WssFileServer server("::", port, 4, CERT_FILE, CERT_KEY_FILE);
+    if (argc >= 4)
+    {
+        server.set_upstream(argv[2], upstream_port, UPSTREAM_CERT_FILE, fetch_thread_num);
+    }
     server.start();
 
     return 0;